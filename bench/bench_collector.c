@@ -0,0 +1,502 @@
+/*
+* Copyright 2018 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+*
+* Licensed under the Apache License, Version 2.0 (the "License").
+* You may not use this file except in compliance with the License.
+* A copy of the License is located at
+*
+* http://aws.amazon.com/apache2.0
+*
+* or in the "license" file accompanying this file. This file is distributed
+* on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+* express or implied. See the License for the specific language governing
+* permissions and limitations under the License.
+*/
+
+/*
+ * Collection benchmark. Generates a synthetic /proc snapshot directory, with net/dev, net/tcp and net/udp files, then
+ * times each collection and encoding step on it. A snapshot recorded on a real host can be replayed instead with -r,
+ * the socket and interface counts are then those of the snapshot.
+ *
+ * diffConnections is measured in the steady state, comparing a list with itself, and sortConnections sorts a copy of
+ * the same list as a baseline. readProcSnapshot opens, reads and closes net/tcp on every call, readSourceFile reads it
+ * again from the descriptor the collector source keeps open.
+ *
+ * Usage: bench_collector [-s sockets] [-i interfaces] [-n iterations] [-d directory] [-r snapshot]
+ *
+ * Results are printed on stdout, one JSON object per step:
+ *   {"benchmark":"parseNetProtocol","sockets":1000,"interfaces":4,"iterations":20,"ns_per_op":...,
+ *    "allocs_per_op":...,"bytes_per_op":...,"syscalls_per_op":...,"peak_rss_kb":...}
+ * Allocations are counted when the benchmark is linked with --wrap=malloc,--wrap=calloc,--wrap=realloc and built
+ * with BENCH_COUNT_ALLOCATIONS, as the bench_collector target does, otherwise they are reported as -1. Only
+ * allocations made by the agent's code are counted, not those made inside libc. In the same way, syscalls_per_op
+ * counts the open, openat, read, pread and close calls made by the agent's code when it is also linked with
+ * --wrap for them, the reads stdio makes for readFile are not counted. peak_rss_kb is the peak resident set size of
+ * the process so far.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "collector.h"
+
+#define DEFAULT_SOCKETS 1000
+#define DEFAULT_INTERFACES 4
+#define DEFAULT_ITERATIONS 20
+// Every step, including the legacy char ** parsers, runs at this size with the default 8 MB stack
+#define MAX_SOCKETS 1000000
+#define MAX_INTERFACES 10000
+
+static long long allocationCount = 0;
+static long long allocatedBytes = 0;
+static long long fileCallCount = 0;
+
+#ifdef BENCH_COUNT_ALLOCATIONS
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocationCount++;
+    allocatedBytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocationCount++;
+    allocatedBytes += count * size;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    allocationCount++;
+    allocatedBytes += size;
+    return __real_realloc(pointer, size);
+}
+
+int __real_open(const char *path, int flags, ...);
+int __real_openat(int directory, const char *path, int flags, ...);
+ssize_t __real_read(int fd, void *buffer, size_t count);
+ssize_t __real_pread(int fd, void *buffer, size_t count, off_t offset);
+int __real_close(int fd);
+
+int __wrap_open(const char *path, int flags, ...) {
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = (flags & O_CREAT) ? va_arg(args, mode_t) : 0;
+    va_end(args);
+    fileCallCount++;
+    return __real_open(path, flags, mode);
+}
+
+int __wrap_openat(int directory, const char *path, int flags, ...) {
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = (flags & O_CREAT) ? va_arg(args, mode_t) : 0;
+    va_end(args);
+    fileCallCount++;
+    return __real_openat(directory, path, flags, mode);
+}
+
+ssize_t __wrap_read(int fd, void *buffer, size_t count) {
+    fileCallCount++;
+    return __real_read(fd, buffer, count);
+}
+
+ssize_t __wrap_pread(int fd, void *buffer, size_t count, off_t offset) {
+    fileCallCount++;
+    return __real_pread(fd, buffer, count, offset);
+}
+
+int __wrap_close(int fd) {
+    fileCallCount++;
+    return __real_close(fd);
+}
+#endif
+
+/**
+ * @brief Input files and reusable state shared by the benchmarked steps
+ */
+typedef struct {
+    const char *root; /** Snapshot directory the files are in */
+    char devPath[PATH_MAX];
+    char tcpPath[PATH_MAX];
+    char udpPath[PATH_MAX];
+    int sockets;
+    int interfaces;
+
+    char **fileLines; /** readFile output */
+    int fileLineCount;
+    ProcSnapshot snapshot;
+    NetworkConnection *parsed; /** parseNetProtocol output */
+    int parsedCount;
+    NetworkConnection *unique;
+    int uniqueCount;
+    ConnectionTable table;
+    ConnectionTable udpTable;
+    ConnectionPartition states;
+    ConnectionHistory history;
+    InterfaceStatsTable netDevInterfaces;
+    NetworkConnection *sorted; /** Copy of the unique connections, sorted by sortConnections */
+    struct Report report;
+    char *reportBuffer;
+    size_t reportBufferSize;
+} BenchContext;
+
+static double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long peakRssKb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static void freeFileLines(BenchContext *context) {
+    for (int i = 0; i < context->fileLineCount; i++) {
+        free(context->fileLines[i]);
+    }
+    context->fileLineCount = 0;
+}
+
+static void benchReadFile(BenchContext *context) {
+    freeFileLines(context);
+    context->fileLineCount = readFile(context->tcpPath, context->fileLines, context->sockets + 1);
+}
+
+static void benchReadProcSnapshot(BenchContext *context) {
+    readProcSnapshot(context->tcpPath, &context->snapshot);
+}
+
+static void benchReadSourceFile(BenchContext *context) {
+    (void) context;
+    readSourceFile(getCollectorSource(), SOURCE_NET_TCP);
+}
+
+static void benchParseNetDev(BenchContext *context) {
+    NetworkStats stats = {0};
+    readProcSnapshot(context->devPath, &context->snapshot);
+    parseNetDevInterfaces(context->snapshot.lines, context->snapshot.lineCount, &context->netDevInterfaces,
+                          &stats);
+}
+
+static void benchParseNetProtocol(BenchContext *context) {
+    parseNetProtocol(context->fileLines, context->fileLineCount, context->parsed, &context->parsedCount);
+}
+
+static void benchParseNetProtocolLines(BenchContext *context) {
+    clearConnectionTable(&context->table);
+    parseNetProtocolLines(context->snapshot.lines, context->snapshot.lineCount, &context->table);
+}
+
+static void benchFilterDuplicateConnections(BenchContext *context) {
+    filterDuplicateConnections(context->parsed, context->parsedCount, context->unique, &context->uniqueCount);
+}
+
+/**
+ * Same steps as generateMetricsReport, reading net/tcp and net/tcp6 from the collector source
+ */
+static void benchCollectTCPConnections(BenchContext *context) {
+    clearConnectionTable(&context->table);
+    collectTCPConnections(&context->table);
+}
+
+static void benchPartitionConnectionsByState(BenchContext *context) {
+    partitionConnectionsByState(&context->table, &context->states);
+}
+
+static void benchDiffConnections(BenchContext *context) {
+    ConnectionDiff diff;
+    diffConnections(&context->history, context->unique, context->uniqueCount, &diff);
+}
+
+/**
+ * Baseline for diffConnections: sorting is how connection lists were compared before
+ */
+static void benchSortConnections(BenchContext *context) {
+    memcpy(context->sorted, context->unique, context->uniqueCount * sizeof(NetworkConnection));
+    qsort(context->sorted, context->uniqueCount, sizeof(NetworkConnection), compare_connections);
+}
+
+static void benchGenerateJSONReport(BenchContext *context) {
+    int length = 0;
+    generateJSONReport(&context->report, context->reportBuffer, context->reportBufferSize, &length, LONG_NAMES);
+}
+
+static void benchGenerateCBORReport(BenchContext *context) {
+    int length = 0;
+    generateCBORReport(&context->report, (uint8_t *) context->reportBuffer, context->reportBufferSize, &length,
+                       LONG_NAMES);
+}
+
+static void runBenchmark(FILE *results, const char *name, void (*step)(BenchContext *), BenchContext *context,
+                         int iterations) {
+    // Warm up, so buffers reused between cycles are sized before measuring. Twice, as diffConnections alternates
+    // between two fingerprint sets
+    step(context);
+    step(context);
+
+    long long allocationsBefore = allocationCount;
+    long long bytesBefore = allocatedBytes;
+    long long fileCallsBefore = fileCallCount;
+    double start = nowNs();
+    for (int i = 0; i < iterations; i++) {
+        step(context);
+    }
+    double elapsed = nowNs() - start;
+
+#ifdef BENCH_COUNT_ALLOCATIONS
+    double allocations = (double) (allocationCount - allocationsBefore) / iterations;
+    double bytes = (double) (allocatedBytes - bytesBefore) / iterations;
+    double fileCalls = (double) (fileCallCount - fileCallsBefore) / iterations;
+#else
+    double allocations = -1;
+    double bytes = -1;
+    double fileCalls = -1;
+    (void) allocationsBefore;
+    (void) bytesBefore;
+    (void) fileCallsBefore;
+#endif
+
+    fprintf(results, "{\"benchmark\":\"%s\",\"sockets\":%d,\"interfaces\":%d,\"iterations\":%d,\"ns_per_op\":%.0f,"
+                     "\"allocs_per_op\":%.1f,\"bytes_per_op\":%.0f,\"syscalls_per_op\":%.1f,\"peak_rss_kb\":%ld}\n",
+            name, context->sockets, context->interfaces, iterations, elapsed / iterations, allocations, bytes,
+            fileCalls, peakRssKb());
+    fflush(results);
+}
+
+static int writeNetDev(const char *path, int interfaces) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    fprintf(file, "Inter-|   Receive                                                |  Transmit\n");
+    fprintf(file, " face |bytes    packets errs drop fifo frame compressed multicast|"
+                  "bytes    packets errs drop fifo colls carrier compressed\n");
+    for (int i = 0; i < interfaces; i++) {
+        unsigned long base = 1000000UL * (i + 1);
+        fprintf(file, "%6s%d: %lu %lu    0    0    0     0          0         0 %lu %lu    0    0    0     0"
+                      "       0          0\n", "eth", i, base, base / 1000, base / 2, base / 2000);
+    }
+    return fclose(file);
+}
+
+/**
+ * Write a socket list in the kernel's format. A quarter of the sockets listen, half are established and the rest are
+ * in TIME_WAIT. One line in 20 repeats the previous socket, as happens when the file changes while it is read.
+ */
+static int writeNetProtocol(const char *path, int sockets, bool udp) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    fprintf(file, "  sl  local_address rem_address   st tx_queue rx_queue tr tm->when retrnsmt   uid  timeout inode\n");
+
+    unsigned int local = 0, localPort = 0, remote = 0, remotePort = 0, state = 0;
+    for (int i = 0; i < sockets; i++) {
+        if (i % 20 != 19) {
+            local = 0x0100000A + ((i % 250) << 24);
+            localPort = 1024 + (i * 7919u) % 60000;
+            if (udp) {
+                remote = 0;
+                remotePort = 0;
+                state = 0x07;
+            } else if (i % 4 == 0) {
+                remote = 0;
+                remotePort = 0;
+                state = 0x0A;
+            } else {
+                remote = 0x0200000A + ((i * 7919u) & 0x00FFFF00);
+                remotePort = 443;
+                state = i % 4 == 3 ? 0x06 : 0x01;
+            }
+        }
+        fprintf(file, "%4d: %08X:%04X %08X:%04X %02X 00000000:00000000 00:00000000 00000000  1000        0 %d 1 "
+                      "0000000000000000 20 4 30 10 -1\n", i, local, localPort, remote, remotePort, state, 10000 + i);
+    }
+    return fclose(file);
+}
+
+static void printUsage(const char *program) {
+    fprintf(stderr, "Usage: %s [-s sockets] [-i interfaces] [-n iterations] [-d directory] [-r snapshot]\n", program);
+}
+
+static int writeSnapshot(BenchContext *context) {
+    char netPath[PATH_MAX];
+    snprintf(netPath, PATH_MAX, "%s/net", context->root);
+    if ((mkdir(context->root, 0755) != 0 && errno != EEXIST) || (mkdir(netPath, 0755) != 0 && errno != EEXIST)) {
+        return -1;
+    }
+    if (writeNetDev(context->devPath, context->interfaces) != 0
+        || writeNetProtocol(context->tcpPath, context->sockets, false) != 0
+        || writeNetProtocol(context->udpPath, context->sockets / 4 + 1, true) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Count the sockets and interfaces of a recorded snapshot, returns -1 if it cannot be read
+ */
+static int countSnapshot(BenchContext *context) {
+    ProcSnapshot snapshot = {0};
+    int tcpLines = readProcSnapshot(context->tcpPath, &snapshot);
+    int devLines = readProcSnapshot(context->devPath, &snapshot);
+    freeProcSnapshot(&snapshot);
+    if (tcpLines < 0 || devLines < 0) {
+        return -1;
+    }
+    context->sockets = tcpLines > 1 ? tcpLines - 1 : 1;
+    context->interfaces = devLines > 2 ? devLines - 2 : 0;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int sockets = DEFAULT_SOCKETS;
+    int interfaces = DEFAULT_INTERFACES;
+    int iterations = DEFAULT_ITERATIONS;
+    const char *directory = ".";
+    const char *recorded = NULL;
+    int opt;
+
+    while (-1 != (opt = getopt(argc, argv, "s:i:n:d:r:"))) {
+        switch (opt) {
+            case 's':
+                sockets = atoi(optarg);
+                break;
+            case 'i':
+                interfaces = atoi(optarg);
+                break;
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'd':
+                directory = optarg;
+                break;
+            case 'r':
+                recorded = optarg;
+                break;
+            default:
+                printUsage(argv[0]);
+                return 1;
+        }
+    }
+    if (sockets < 1 || sockets > MAX_SOCKETS || interfaces < 1 || interfaces > MAX_INTERFACES || iterations < 1) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    BenchContext context;
+    memset(&context, 0, sizeof(context));
+    context.sockets = sockets;
+    context.interfaces = interfaces;
+    char generated[PATH_MAX];
+    int generatedLength = snprintf(generated, PATH_MAX, "%s/bench_proc", directory);
+    context.root = recorded != NULL ? recorded : generated;
+    // Like openCollectorSource, reject roots whose file paths would not fit
+    if ((recorded == NULL && (generatedLength < 0 || generatedLength >= PATH_MAX)) ||
+        strlen(context.root) + strlen("/net/dev") >= PATH_MAX) {
+        fprintf(stderr, "Snapshot directory %s is too long\n", recorded != NULL ? recorded : directory);
+        return 1;
+    }
+    snprintf(context.devPath, PATH_MAX, "%s/net/dev", context.root);
+    snprintf(context.tcpPath, PATH_MAX, "%s/net/tcp", context.root);
+    snprintf(context.udpPath, PATH_MAX, "%s/net/udp", context.root);
+    PROC_ROOT = context.root;
+
+    if (recorded != NULL && countSnapshot(&context) != 0) {
+        fprintf(stderr, "Unable to read the snapshot in %s\n", recorded);
+        return 1;
+    }
+    if (recorded == NULL && writeSnapshot(&context) != 0) {
+        fprintf(stderr, "Unable to write fixtures to %s\n", directory);
+        return 1;
+    }
+    sockets = context.sockets;
+
+    context.fileLines = calloc(sockets + 1, sizeof(char *));
+    context.parsed = calloc(sockets, sizeof(NetworkConnection));
+    context.unique = calloc(sockets, sizeof(NetworkConnection));
+    context.sorted = calloc(sockets, sizeof(NetworkConnection));
+    context.reportBufferSize = (size_t) sockets * 128 + 65536;
+    context.reportBuffer = malloc(context.reportBufferSize);
+    initConnectionTable(&context.table, 0);
+    initConnectionTable(&context.udpTable, 0);
+    if (context.fileLines == NULL || context.parsed == NULL || context.unique == NULL || context.sorted == NULL
+        || context.reportBuffer == NULL) {
+        fprintf(stderr, "Unable to allocate memory for %d sockets\n", sockets);
+        return 1;
+    }
+
+    // Results go to the original stdout, the collector's progress messages are discarded
+    fflush(stdout);
+    FILE *results = fdopen(dup(STDOUT_FILENO), "w");
+    int devNull = open("/dev/null", O_WRONLY);
+    if (results == NULL || devNull < 0) {
+        fprintf(stderr, "Unable to redirect output\n");
+        return 1;
+    }
+    dup2(devNull, STDOUT_FILENO);
+    close(devNull);
+
+    runBenchmark(results, "readFile", benchReadFile, &context, iterations);
+    runBenchmark(results, "readProcSnapshot", benchReadProcSnapshot, &context, iterations);
+    runBenchmark(results, "readSourceFile", benchReadSourceFile, &context, iterations);
+    runBenchmark(results, "parseNetProtocol", benchParseNetProtocol, &context, iterations);
+    runBenchmark(results, "parseNetProtocolLines", benchParseNetProtocolLines, &context, iterations);
+    runBenchmark(results, "filterDuplicateConnections", benchFilterDuplicateConnections, &context, iterations);
+    runBenchmark(results, "partitionConnectionsByState", benchPartitionConnectionsByState, &context, iterations);
+    runBenchmark(results, "diffConnections", benchDiffConnections, &context, iterations);
+    runBenchmark(results, "sortConnections", benchSortConnections, &context, iterations);
+    runBenchmark(results, "parseNetDev", benchParseNetDev, &context, iterations);
+    runBenchmark(results, "collectTCPConnections", benchCollectTCPConnections, &context, iterations);
+
+    // Reports carry the unique TCP connections and listening ports, as generateMetricsReport builds them
+    clearConnectionTable(&context.table);
+    getAllTCPConnections(context.tcpPath, &context.table);
+    partitionConnectionsByState(&context.table, &context.states);
+    context.report.header.reportId = 1;
+    context.report.header.version = "1.0";
+    context.report.metrics.tcpConnections = connectionsInState(&context.table, &context.states, ESTABLISHED);
+    context.report.metrics.tcpConnectionCount = context.report.metrics.tcpConnections.count;
+    context.report.metrics.listeningTCPPorts = connectionsInState(&context.table, &context.states, LISTEN);
+    context.report.metrics.tcpPortCount = context.report.metrics.listeningTCPPorts.count;
+    getAllListeningUDPPorts(context.udpPath, &context.udpTable);
+    context.report.metrics.listeningUDPPorts.connections = context.udpTable.connections;
+    context.report.metrics.listeningUDPPorts.count = context.udpTable.count;
+    context.report.metrics.udpPortCount = context.udpTable.count;
+    context.report.metrics.networkStats.bytesInDelta = 1000000;
+    context.report.metrics.networkStats.bytesOutDelta = 500000;
+    context.report.metrics.networkStats.packetsInDelta = 1000;
+    context.report.metrics.networkStats.packetsOutDelta = 500;
+
+    runBenchmark(results, "generateJSONReport", benchGenerateJSONReport, &context, iterations);
+    runBenchmark(results, "generateCBORReport", benchGenerateCBORReport, &context, iterations);
+
+    fclose(results);
+    freeFileLines(&context);
+    freeProcSnapshot(&context.snapshot);
+    freeConnectionTable(&context.table);
+    freeConnectionTable(&context.udpTable);
+    freeConnectionPartition(&context.states);
+    free(context.fileLines);
+    free(context.parsed);
+    free(context.unique);
+    free(context.sorted);
+    freeConnectionHistory(&context.history);
+    freeInterfaceStatsTable(&context.netDevInterfaces);
+    free(context.reportBuffer);
+    return 0;
+}
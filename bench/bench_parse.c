@@ -0,0 +1,217 @@
+/*
+* Copyright 2018 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+*
+* Licensed under the Apache License, Version 2.0 (the "License").
+* You may not use this file except in compliance with the License.
+* A copy of the License is located at
+*
+* http://aws.amazon.com/apache2.0
+*
+* or in the "license" file accompanying this file. This file is distributed
+* on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either
+* express or implied. See the License for the specific language governing
+* permissions and limitations under the License.
+*/
+
+/*
+ * Microbenchmark of /proc/net/tcp line parsing: the strtok/strtoul tokenizer the collector used to have, against
+ * the fixed-column scanner. The fixture's socket lines are repeated to build a file of BENCH_LINES lines.
+ *
+ * Usage: bench_parse [fixture] [lines]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "collector.h"
+
+#define BENCH_LINES 100000
+#define BENCH_ITERATIONS 10
+#define LEGACY_MAX_CHAR 1000
+
+/**
+ * @brief The string based connection record the legacy tokenizer filled
+ */
+typedef struct {
+    char localInterface[MAX_INTERFACE_NAME_LENGTH];
+    char localAddress[MAX_IP_ADDR_STRING_LENGTH];
+    char localPort[MAX_PORT_STRING_LENGTH];
+    char remoteAddress[MAX_IP_ADDR_STRING_LENGTH];
+    char remotePort[MAX_PORT_STRING_LENGTH];
+    enum state connectionState;
+} LegacyConnection;
+
+/**
+ * Copy of the previous hexAddrToIpStr, IPv4 only, through strtoul and inet_ntoa
+ */
+static void legacyHexAddrToIpStr(const char *hexAddr, char ipStr[], const int ipStrLength) {
+    uint32_t addrNum = (uint32_t) strtoul(hexAddr, NULL, 16);
+    struct in_addr addr;
+    addr.s_addr = addrNum; // hexAddr is in network byte order already
+    char *s = inet_ntoa(addr);
+
+    snprintf(ipStr, ipStrLength, "%s", s);
+}
+
+/**
+ * Copy of the previous hexPortToTcpPort, through strtol and snprintf
+ */
+static void legacyHexPortToTcpPort(const char *hexPort, char portStr[], const int portStrLength) {
+    int port = (int) strtol(hexPort, NULL, 16);
+    snprintf(portStr, portStrLength, "%i", port);
+}
+
+/**
+ * Copy of the previous parseNetProtocol: copy the line, strtok it and convert each token with strtoul/snprintf
+ */
+static int legacyParseNetProtocol(const LineView lines[], int fileLines, LegacyConnection connections[]) {
+    int numConnections = 0;
+    char *charPtr;
+    char tempAddr[MAX_IP_ADDR_STRING_LENGTH];
+    char tempLine[LEGACY_MAX_CHAR];
+    int tokNum = 0;
+
+    for (int line = 1; line < fileLines; line++) {
+        tokNum = 0;
+        size_t lineLength = lines[line].length < LEGACY_MAX_CHAR ? lines[line].length : LEGACY_MAX_CHAR - 1;
+        memcpy(tempLine, lines[line].text, lineLength);
+        tempLine[lineLength] = '\0';
+        charPtr = strtok(tempLine, " :");
+
+        LegacyConnection *connection = &connections[numConnections];
+        connection->localAddress[0] = '\0';
+        connection->localPort[0] = '\0';
+        connection->localInterface[0] = '\0';
+        connection->remoteAddress[0] = '\0';
+        connection->remotePort[0] = '\0';
+
+        while (charPtr != NULL) {
+            switch (tokNum) {
+                case 1:
+                    legacyHexAddrToIpStr(charPtr, tempAddr, MAX_IP_ADDR_STRING_LENGTH);
+                    strcpy(connection->localAddress, tempAddr);
+                    break;
+                case 2:
+                    legacyHexPortToTcpPort(charPtr, tempAddr, MAX_IP_ADDR_STRING_LENGTH);
+                    strcpy(connection->localPort, tempAddr);
+                    break;
+                case 3:
+                    legacyHexAddrToIpStr(charPtr, tempAddr, MAX_IP_ADDR_STRING_LENGTH);
+                    strcpy(connection->remoteAddress, tempAddr);
+                    break;
+                case 4:
+                    legacyHexPortToTcpPort(charPtr, tempAddr, MAX_IP_ADDR_STRING_LENGTH);
+                    strcpy(connection->remotePort, tempAddr);
+                    break;
+                case 5:
+                    if (strcmp("01", charPtr) == 0) {
+                        connection->connectionState = ESTABLISHED;
+                    } else if (strcmp("0A", charPtr) == 0) {
+                        connection->connectionState = LISTEN;
+                    } else {
+                        connection->connectionState = OTHER;
+                    }
+                    break;
+                default :
+                    break;
+            }
+            charPtr = strtok(NULL, " :");
+            tokNum++;
+        }
+        numConnections++;
+    }
+    return numConnections;
+}
+
+static double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, double bestNs, int lines, double baselineNs) {
+    printf("%-24s %10.1f ns/line %8.2f ms/file", name, bestNs / lines, bestNs / 1e6);
+    if (baselineNs > 0) {
+        printf("  %5.2fx", baselineNs / bestNs);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *fixture = argc > 1 ? argv[1] : "../test/data/proc/net/tcp";
+    int lineCount = argc > 2 ? atoi(argv[2]) : BENCH_LINES;
+
+    ProcSnapshot source = {0};
+    int sourceLines = readProcSnapshot(fixture, &source);
+    if (sourceLines < 2 || lineCount < 2) {
+        printf("Unable to read socket lines from %s\n", fixture);
+        return 1;
+    }
+
+    // Header plus the fixture's socket lines repeated, renumbered like the kernel does
+    size_t textSize = (size_t) lineCount * 256;
+    char *text = malloc(textSize);
+    LineView *lines = malloc(lineCount * sizeof(LineView));
+    size_t offset = 0;
+    for (int i = 0; i < lineCount; i++) {
+        const LineView *from = &source.lines[i == 0 ? 0 : 1 + (i - 1) % (sourceLines - 1)];
+        const char *fields = strchr(from->text, ':');
+        if (i > 0 && fields == NULL) {
+            printf("Malformed socket line in %s: %s\n", fixture, from->text);
+            return 1;
+        }
+        int written = i == 0 ? snprintf(text + offset, textSize - offset, "%s", from->text)
+                             : snprintf(text + offset, textSize - offset, "%4d%s", i - 1, fields);
+        lines[i].text = text + offset;
+        lines[i].length = written;
+        offset += written + 1;
+    }
+
+    LegacyConnection *legacy = malloc(lineCount * sizeof(LegacyConnection));
+    ConnectionTable table = {0};
+    reserveConnections(&table, lineCount);
+
+    double legacyBest = 0, scanBest = 0, parseBest = 0;
+    int legacyCount = 0, scanCount = 0;
+    for (int iteration = 0; iteration < BENCH_ITERATIONS; iteration++) {
+        double start = nowNs();
+        legacyCount = legacyParseNetProtocol(lines, lineCount, legacy);
+        double elapsed = nowNs() - start;
+        legacyBest = (iteration == 0 || elapsed < legacyBest) ? elapsed : legacyBest;
+
+        start = nowNs();
+        scanCount = 0;
+        for (int line = 1; line < lineCount; line++) {
+            ProcSocketEntry entry;
+            scanCount += scanProcNetLine(lines[line].text, lines[line].length, &entry);
+        }
+        elapsed = nowNs() - start;
+        scanBest = (iteration == 0 || elapsed < scanBest) ? elapsed : scanBest;
+
+        start = nowNs();
+        clearConnectionTable(&table);
+        parseNetProtocolLines(lines, lineCount, &table);
+        elapsed = nowNs() - start;
+        parseBest = (iteration == 0 || elapsed < parseBest) ? elapsed : parseBest;
+    }
+
+    printf("%s scaled to %d lines, best of %d\n", fixture, lineCount, BENCH_ITERATIONS);
+    report("legacy strtok/strtoul", legacyBest, lineCount, 0);
+    report("scanProcNetLine", scanBest, lineCount, legacyBest);
+    report("parseNetProtocolLines", parseBest, lineCount, legacyBest);
+
+    int status = (legacyCount == scanCount && scanCount == table.count) ? 0 : 1;
+    if (status != 0) {
+        printf("Mismatched line counts: legacy %d, scan %d, parse %d\n", legacyCount, scanCount, table.count);
+    }
+
+    freeConnectionTable(&table);
+    freeProcSnapshot(&source);
+    free(legacy);
+    free(lines);
+    free(text);
+    return status;
+}